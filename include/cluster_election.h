@@ -0,0 +1,125 @@
+#pragma once
+
+// ==========================================
+//        CLUSTER ELECTION (hardware-free)
+// ==========================================
+// Digest format, peer tracking and forwarder election for cluster mode.
+// Nothing here touches Arduino or the radio, so it is unit tested on the
+// host: pio test -e native
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GW_UID_LEN      13   // 12 hex digits of the eFuse MAC
+#define CLUSTER_MSG_LEN 96
+
+// A peer's report of one frame. Empty gw = free slot.
+struct PeerDigest {
+  uint32_t hash;
+  int rssi;
+  int snr_q;  // SNR in quarter dB, as sent on the wire
+  char gw[GW_UID_LEN];
+  unsigned long seen_at;
+};
+
+struct ClusterPeer {
+  char gw[GW_UID_LEN];
+  unsigned long last_seen;
+};
+
+enum ClusterMsgType {
+  CLUSTER_MSG_INVALID,
+  CLUSTER_MSG_HEARTBEAT,
+  CLUSTER_MSG_DIGEST
+};
+
+// FNV-1a over the raw frame; every gateway hears the same bytes, so this
+// identifies one transmission across the cluster.
+inline uint32_t frameHash(const char* data, size_t len) {
+  uint32_t h = 2166136261UL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)data[i];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+// Strongest RSSI wins, then SNR, then the lower gateway id as tie-break.
+inline bool signalBeats(int rssiA, int snrA, const char* gwA,
+                        int rssiB, int snrB, const char* gwB) {
+  if (rssiA != rssiB) return rssiA > rssiB;
+  if (snrA != snrB) return snrA > snrB;
+  return strcmp(gwA, gwB) < 0;
+}
+
+// Coordination message is "<gw>" (heartbeat) or "<gw>,<node>,<hash>,<rssi>,<snr_q>",
+// with SNR in integer quarter dB so every gateway compares identical values.
+inline int formatClusterDigest(char* out, size_t outSize, const char* gw,
+                               const char* node, uint32_t hash, int rssi,
+                               int snr_q) {
+  return snprintf(out, outSize, "%s,%s,%08lx,%d,%d",
+                  gw, node, (unsigned long)hash, rssi, snr_q);
+}
+
+// Parses a coordination message in place into d (all but seen_at). The node
+// id may contain commas, so the numeric fields are taken from the end.
+inline ClusterMsgType parseClusterMessage(char* msg, PeerDigest* d) {
+  char* sep = strchr(msg, ',');
+  if (sep) *sep = '\0';
+  if (msg[0] == '\0' || strlen(msg) >= sizeof(d->gw)) return CLUSTER_MSG_INVALID;
+  strcpy(d->gw, msg);
+  if (!sep) return CLUSTER_MSG_HEARTBEAT;
+
+  char* fields[3];
+  for (int i = 2; i >= 0; i--) {
+    char* comma = strrchr(sep + 1, ',');
+    if (!comma) return CLUSTER_MSG_INVALID;
+    *comma = '\0';
+    fields[i] = comma + 1;
+  }
+
+  d->hash = strtoul(fields[0], nullptr, 16);
+  d->rssi = atoi(fields[1]);
+  d->snr_q = atoi(fields[2]);
+  return CLUSTER_MSG_DIGEST;
+}
+
+// Marks gw as heard at now, replacing the least recently heard peer if new.
+inline void touchClusterPeer(ClusterPeer* peers, size_t count, const char* gw,
+                             unsigned long now) {
+  ClusterPeer* slot = nullptr;
+  for (size_t i = 0; i < count; i++) {
+    ClusterPeer& p = peers[i];
+    if (strcmp(p.gw, gw) == 0) { p.last_seen = now; return; }
+    if (!slot || now - p.last_seen > now - slot->last_seen) slot = &p;
+  }
+  strncpy(slot->gw, gw, sizeof(slot->gw) - 1);
+  slot->gw[sizeof(slot->gw) - 1] = '\0';
+  slot->last_seen = now;
+}
+
+inline int countLivePeers(const ClusterPeer* peers, size_t count,
+                          unsigned long now, unsigned long timeout) {
+  int live = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (peers[i].gw[0] != '\0' && now - peers[i].last_seen < timeout) live++;
+  }
+  return live;
+}
+
+// True if a digest younger than lifetime reports the same frame with a
+// better signal than ours; false (we forward) if none does.
+inline bool anyPeerHeardBetter(const PeerDigest* digests, size_t count,
+                               uint32_t hash, int rssi, int snr_q,
+                               const char* self, unsigned long now,
+                               unsigned long lifetime) {
+  for (size_t i = 0; i < count; i++) {
+    const PeerDigest& d = digests[i];
+    if (d.gw[0] == '\0' || d.hash != hash || now - d.seen_at > lifetime) continue;
+    if (signalBeats(d.rssi, d.snr_q, d.gw, rssi, snr_q, self)) return true;
+  }
+  return false;
+}
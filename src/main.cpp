@@ -10,6 +10,10 @@
 #include <set>
 #include <ArduinoOTA.h>
 #include <esp_task_wdt.h>
+#include <esp_timer.h>
+#include <esp_sntp.h>
+#include <time.h>
+#include "cluster_election.h"
 
 // ==========================================
 //        HARDWARE PINS (TTGO LoRa32 V2.1)
@@ -22,6 +26,10 @@
 #define DI0_PIN  26
 #define BAND 868E6
 #define LORA_SF  9   // Must match sender spreading factor (7-12)
+#define NTP_SERVER "pool.ntp.org"
+#define PAYLOAD_LATENCY 1  // Add gateway processing latency ("lat_ms") to payloads
+#define PUBLISH_BENCHMARK 0  // Set to 1 to benchmark publish paths once after the first MQTT connect
+#define BENCHMARK_MSGS    200
 
 // ==========================================
 //              TIMING CONSTANTS
@@ -33,6 +41,12 @@
 #define WAKE_ON_SAVE_MS        10000
 #define WAKE_ON_PACKET_MS      5000
 #define STATUS_PUBLISH_MS      60000
+#define UNKNOWN_REFILL_MS      2000   // One unknown-frame token per interval
+#define UNKNOWN_BURST          5      // Token bucket capacity
+#define CLOCK_STEP_US          500000 // SNTP error above this steps the clock, below it slews
+#define CLUSTER_HEARTBEAT_MS   10000  // Presence announcement on the coordination topic
+#define CLUSTER_PEER_TIMEOUT_MS 30000 // Peer considered silent after this long
+#define CLUSTER_DIGEST_SLACK_MS 1000  // Extra lifetime of peer digests beyond the hold window
 #define WDT_TIMEOUT_S          30
 
 // ==========================================
@@ -42,7 +56,16 @@
 #define FIELD_LEN        40
 #define PORT_LEN         6
 #define ALLOWLIST_LEN    200
+#define MODE_LEN         8
+#define UNKNOWN_NODE_SLOTS 16  // Fixed-size LRU table of unapproved nodes
+#define CLUSTER_MAX_PEERS    8
+#define CLUSTER_HELD_SLOTS   8
+#define CLUSTER_DIGEST_SLOTS 16
+#define QOS_LEN              2
+#define PUBLISH_QUEUE_LEN    32    // Messages waiting for the next pipeline flush
+#define MQTT_INFLIGHT_MAX    8     // QoS 1 publishes awaiting PUBACK
 #define LORA_MAX_PACKET  255
+#define COALESCE_BUF_LEN 1460  // One TCP segment's worth of MQTT packets
 
 // ==========================================
 //              LOGO BITMAP
@@ -119,6 +142,10 @@ char mqtt_pass[FIELD_LEN] = "";
 char mqtt_topic[FIELD_LEN] = "lora/incoming";
 char device_name[FIELD_LEN] = "LoRaGateway";
 char allowed_nodes[ALLOWLIST_LEN] = "";
+char publish_mode[MODE_LEN] = "json";   // "json" = one blob per node, "split" = one topic per field
+char cluster_hold[PORT_LEN] = "0";      // Cluster election hold window in ms, "0" = cluster mode off
+char mqtt_qos[QOS_LEN] = "0";           // QoS for pipeline publishes: "0" or "1"
+char gw_uid[GW_UID_LEN] = "";           // Unique gateway id used on the coordination topic
 
 bool shouldSaveConfig = false;
 unsigned long lastScreenUpdate = 0;
@@ -127,17 +154,219 @@ bool isScreenOn = true;
 unsigned long lastStatusPublish = 0;
 unsigned long packetCount = 0;
 
-// Nodes seen on-air but not yet approved (in-memory only, re-populated on receive)
-std::set<String> pending_nodes;
+// Nodes seen on-air but not yet approved (in-memory only, re-populated on receive).
+// Fixed capacity so a flood of random IDs cannot exhaust the heap; the least
+// recently seen entry is evicted when the table is full. Empty id = free slot.
+struct UnknownNode {
+  char id[FIELD_LEN];
+  unsigned long first_seen;
+  unsigned long last_seen;
+  unsigned long count;
+  int last_rssi;
+};
+UnknownNode unknown_nodes[UNKNOWN_NODE_SLOTS];
+
+// Token bucket limiting how often unknown frames may log and redraw the OLED
+unsigned long unknownTokens = UNKNOWN_BURST;
+unsigned long lastUnknownRefill = 0;
+
+unsigned long unknownFrames = 0;    // Frames from unapproved IDs
+unsigned long unknownDropped = 0;   // ...of which handled silently (bucket empty or id too long)
+unsigned long unknownEvicted = 0;   // Table entries evicted to make room
+
+// Receive timestamps: DIO0 (RxDone) is stamped from the monotonic esp_timer
+// clock in an ISR; utcOffsetUs maps that clock to UTC once SNTP has synced.
+volatile int64_t rxDoneUs = 0;
+int64_t utcOffsetUs = 0;
+bool clockSynced = false;
+bool sntpStarted = false;
+portMUX_TYPE clockMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Receive-to-publish latency since the last gateway state publish
+unsigned long latencyCount = 0;
+unsigned long latencySumMs = 0;
+unsigned long latencyMaxMs = 0;
 
 // Set for O(1) lookup of already-discovered nodes
 std::set<String> discovered_nodes;
 
+// Cluster mode: frames from approved nodes are held for the hold window while
+// gateways exchange "heard" digests; only the best-signal gateway forwards.
+struct HeldFrame {
+  bool used;
+  uint32_t hash;
+  int rssi;
+  int snr_q;  // SNR in quarter dB, as sent on the wire
+  unsigned long heard_at;
+  int64_t rx_us;
+  String id;
+  String topic;
+  String payload;
+};
+HeldFrame held_frames[CLUSTER_HELD_SLOTS];
+
+// Recent digests from peers, overwritten round-robin
+PeerDigest peer_digests[CLUSTER_DIGEST_SLOTS];
+size_t nextPeerDigest = 0;
+
+ClusterPeer cluster_peers[CLUSTER_MAX_PEERS];
+
+unsigned long lastClusterHeartbeat = 0;
+unsigned long clusterForwarded = 0;   // Held frames we won and forwarded
+unsigned long clusterSuppressed = 0;  // Held frames a peer heard better
+
+// Publish pipeline: all outgoing messages are queued and flushed together
+// once per loop. QoS 1 messages then wait in the in-flight window, keyed by
+// packet id, until their PUBACK arrives.
+struct OutMsg {
+  String topic;
+  String payload;
+  bool retain;
+  uint8_t qos;
+  int64_t rx_us;  // Receive stamp for latency accounting, 0 if none
+};
+OutMsg publish_queue[PUBLISH_QUEUE_LEN];
+size_t queueHead = 0;
+size_t queueCount = 0;
+
+struct InFlight {
+  bool used;
+  uint16_t packet_id;
+  bool retain;
+  String topic;
+  String payload;
+};
+InFlight in_flight[MQTT_INFLIGHT_MAX];
+uint16_t nextPacketId = 1;
+
+unsigned long mqttSessions = 0;      // Incremented on every successful connect
+unsigned long pipelineSession = 0;   // Session the in-flight window was last sent on
+unsigned long pubSent = 0;
+unsigned long pubAcked = 0;
+unsigned long pubDropped = 0;
+unsigned long pubRetransmits = 0;
+
+// ==========================================
+//        COALESCING MQTT TRANSPORT
+// ==========================================
+// WiFiClient that can hold back writes between cork() and uncork() so a
+// burst of small MQTT packets leaves in a single socket write. Outside a
+// cork()/uncork() pair it behaves exactly like WiFiClient.
+//
+// It also follows MQTT packet framing on the receive path: PubSubClient
+// reads and discards PUBACKs, so they are reported from here to the
+// publish pipeline's QoS 1 window.
+class CoalescingClient : public WiFiClient {
+public:
+  typedef void (*PubackHandler)(uint16_t packetId);
+
+  unsigned long socketWrites = 0;  // Writes handed to lwIP
+  unsigned long socketBytes = 0;
+
+  void onPuback(PubackHandler handler) { pubackHandler = handler; }
+
+  void cork() { corked = true; }
+
+  void uncork() {
+    corked = false;
+    flushPending();
+  }
+
+  size_t write(const uint8_t* buf, size_t size) override {
+    if (!corked) return rawWrite(buf, size);
+    if (pendingLen + size > sizeof(pending)) flushPending();
+    if (size > sizeof(pending)) return rawWrite(buf, size);
+    memcpy(pending + pendingLen, buf, size);
+    pendingLen += size;
+    return size;
+  }
+
+  void flush() override {
+    flushPending();
+    WiFiClient::flush();
+  }
+
+  // Single-byte reads are routed through read(buf, size) so every received
+  // byte is seen by the framer exactly once.
+  int read() override {
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+  }
+
+  int read(uint8_t* buf, size_t size) override {
+    int n = WiFiClient::read(buf, size);
+    for (int i = 0; i < n; i++) trackRx(buf[i]);
+    return n;
+  }
+
+  void stop() override {
+    pendingLen = 0;
+    corked = false;
+    rxState = RX_HEADER;
+    WiFiClient::stop();
+  }
+
+private:
+  enum RxState { RX_HEADER, RX_LENGTH, RX_BODY };
+
+  size_t rawWrite(const uint8_t* buf, size_t size) {
+    size_t n = WiFiClient::write(buf, size);
+    socketWrites++;
+    socketBytes += n;
+    return n;
+  }
+
+  void flushPending() {
+    if (pendingLen == 0) return;
+    rawWrite(pending, pendingLen);
+    pendingLen = 0;
+  }
+
+  void trackRx(uint8_t b) {
+    switch (rxState) {
+      case RX_HEADER:
+        rxType = b & 0xF0;
+        rxRemaining = 0;
+        rxShift = 0;
+        rxPos = 0;
+        rxPacketId = 0;
+        rxState = RX_LENGTH;
+        break;
+      case RX_LENGTH:
+        rxRemaining |= (uint32_t)(b & 0x7F) << rxShift;
+        rxShift += 7;
+        if (!(b & 0x80)) rxState = rxRemaining > 0 ? RX_BODY : RX_HEADER;
+        break;
+      case RX_BODY:
+        if (rxPos < 2) rxPacketId = (rxPacketId << 8) | b;
+        if (++rxPos == rxRemaining) {
+          if (rxType == 0x40 && rxRemaining == 2 && pubackHandler) {
+            pubackHandler(rxPacketId);
+          }
+          rxState = RX_HEADER;
+        }
+        break;
+    }
+  }
+
+  uint8_t pending[COALESCE_BUF_LEN];
+  size_t pendingLen = 0;
+  bool corked = false;
+
+  PubackHandler pubackHandler = nullptr;
+  RxState rxState = RX_HEADER;
+  uint8_t rxType = 0;
+  uint32_t rxRemaining = 0;
+  uint8_t rxShift = 0;
+  uint32_t rxPos = 0;
+  uint16_t rxPacketId = 0;
+};
+
 // ==========================================
 //             GLOBAL OBJECTS
 // ==========================================
 SSD1306 display(0x3C, 21, 22);
-WiFiClient espClient;
+CoalescingClient espClient;
 PubSubClient client(espClient);
 Preferences preferences;
 WiFiManager wm;
@@ -149,6 +378,9 @@ WiFiManagerParameter custom_mqtt_port("port", "MQTT Port", "1883", PORT_LEN);
 WiFiManagerParameter custom_mqtt_user("user", "MQTT User", "", FIELD_LEN);
 WiFiManagerParameter custom_mqtt_pass("pass", "MQTT Password", "", FIELD_LEN);
 WiFiManagerParameter custom_mqtt_topic("topic", "MQTT Base Topic", "lora/incoming", FIELD_LEN);
+WiFiManagerParameter custom_pub_mode("pubmode", "Publish Mode (json/split)", "json", MODE_LEN);
+WiFiManagerParameter custom_cluster("cluster", "Cluster Hold ms (0 = off)", "0", PORT_LEN);
+WiFiManagerParameter custom_mqtt_qos("qos", "MQTT QoS (0/1)", "0", QOS_LEN);
 
 void saveConfigCallback () {
   Serial.println("Settings changed via Web Portal!");
@@ -164,25 +396,145 @@ void safeCopy(char* dest, const char* src, size_t destSize) {
   dest[destSize - 1] = '\0';
 }
 
-bool isNodeAllowed(const String& id) {
-  String list = String(allowed_nodes);
-  list.trim();
-  if (list.length() == 0) return false;
-
-  int start = 0;
-  while (start <= (int)list.length()) {
-    int comma = list.indexOf(',', start);
-    if (comma == -1) comma = list.length();
-    String entry = list.substring(start, comma);
-    entry.trim();
-    if (entry.equalsIgnoreCase(id)) return true;
-    start = comma + 1;
+// Scans allowed_nodes in place; called for every frame, so no heap use.
+bool isNodeAllowed(const char* id) {
+  size_t idLen = strlen(id);
+  if (idLen == 0) return false;
+
+  const char* p = allowed_nodes;
+  while (*p) {
+    while (*p == ' ' || *p == ',') p++;
+    const char* end = p;
+    while (*end && *end != ',') end++;
+    const char* last = end;
+    while (last > p && last[-1] == ' ') last--;
+    if ((size_t)(last - p) == idLen && strncasecmp(p, id, idLen) == 0) return true;
+    p = end;
   }
   return false;
 }
 
+// Finds the top-level "id" member of a raw JSON frame without a full parse,
+// so frames from unapproved nodes can be rejected cheaply. Only keys at
+// object depth 1 are considered, and only ids whose text is exactly what
+// deserializeJson would give: plain strings without escapes and plain
+// integers. Anything else returns false and the frame takes the normal
+// deserializeJson path.
+bool peekNodeId(const char* json, char* out, size_t outSize) {
+  const char* p = json;
+  while (isspace((unsigned char)*p)) p++;
+  if (*p != '{') return false;
+
+  int depth = 0;
+  bool expectKey = false;
+  for (; *p; p++) {
+    char c = *p;
+    if (c == '"') {
+      const char* key = p + 1;
+      for (p++; *p && *p != '"'; p++) {
+        if (*p == '\\' && p[1]) p++;
+      }
+      if (!*p) return false;
+      if (depth == 1 && expectKey) {
+        expectKey = false;
+        if (p - key == 2 && strncmp(key, "id", 2) == 0) {
+          p++;
+          break;
+        }
+      }
+    } else if (c == '{' || c == '[') {
+      depth++;
+      expectKey = (c == '{' && depth == 1);
+    } else if (c == '}' || c == ']') {
+      depth--;
+    } else if (c == ',' && depth == 1) {
+      expectKey = true;
+    }
+  }
+  if (!*p) return false;
+
+  while (isspace((unsigned char)*p)) p++;
+  if (*p++ != ':') return false;
+  while (isspace((unsigned char)*p)) p++;
+
+  size_t n = 0;
+  if (*p == '"') {
+    p++;
+    while (*p && *p != '"') {
+      if (*p == '\\' || n + 1 >= outSize) return false;
+      out[n++] = *p++;
+    }
+    if (*p != '"') return false;
+  } else {
+    if (*p == '-') out[n++] = *p++;
+    const char* digits = p;
+    while (isdigit((unsigned char)*p)) {
+      if (n + 1 >= outSize) return false;
+      out[n++] = *p++;
+    }
+    if (p == digits || (*digits == '0' && p - digits > 1)) return false;
+    if (*p != ',' && *p != '}' && !isspace((unsigned char)*p)) return false;
+  }
+  if (n == 0) return false;
+  out[n] = '\0';
+  return true;
+}
+
+UnknownNode* findUnknownNode(const char* id) {
+  for (UnknownNode& n : unknown_nodes) {
+    if (n.id[0] != '\0' && strcasecmp(n.id, id) == 0) return &n;
+  }
+  return nullptr;
+}
+
+// Records a frame from an unapproved node. Returns false, without touching
+// the table, for ids too long to store in full: a truncated entry would
+// never match again and could not be approved.
+bool trackUnknownNode(const char* id, int rssi) {
+  if (strlen(id) >= sizeof(UnknownNode::id)) return false;
+
+  unsigned long now = millis();
+  UnknownNode* slot = findUnknownNode(id);
+  if (slot) {
+    slot->last_seen = now;
+    slot->count++;
+    slot->last_rssi = rssi;
+    return true;
+  }
+
+  for (UnknownNode& n : unknown_nodes) {
+    if (n.id[0] == '\0') { slot = &n; break; }
+    if (!slot || now - n.last_seen > now - slot->last_seen) slot = &n;
+  }
+  if (slot->id[0] != '\0') unknownEvicted++;
+
+  safeCopy(slot->id, id, sizeof(slot->id));
+  slot->first_seen = now;
+  slot->last_seen = now;
+  slot->count = 1;
+  slot->last_rssi = rssi;
+  return true;
+}
+
+void forgetUnknownNode(const char* id) {
+  UnknownNode* n = findUnknownNode(id);
+  if (n) n->id[0] = '\0';
+}
+
+bool takeUnknownToken() {
+  unsigned long now = millis();
+  unsigned long earned = (now - lastUnknownRefill) / UNKNOWN_REFILL_MS;
+  if (earned > 0) {
+    unknownTokens = min(unknownTokens + earned, (unsigned long)UNKNOWN_BURST);
+    lastUnknownRefill += earned * UNKNOWN_REFILL_MS;
+  }
+  if (unknownTokens == 0) return false;
+  unknownTokens--;
+  return true;
+}
+
 void approveNode(const String& id) {
-  if (isNodeAllowed(id)) return;
+  if (isNodeAllowed(id.c_str())) return;
 
   String list = String(allowed_nodes);
   list.trim();
@@ -191,7 +543,7 @@ void approveNode(const String& id) {
   safeCopy(allowed_nodes, list.c_str(), sizeof(allowed_nodes));
 
   preferences.putString("allow", allowed_nodes);
-  pending_nodes.erase(id);
+  forgetUnknownNode(id.c_str());
   Serial.println("APPROVED node: " + id);
 }
 
@@ -220,6 +572,21 @@ String availabilityTopic() {
   return String(mqtt_topic) + "/gateway/status";
 }
 
+// In split mode every reading field goes to its own topic as a plain value,
+// so Home Assistant entities need no value template.
+bool splitTopics() {
+  return strcasecmp(publish_mode, "split") == 0;
+}
+
+String clusterTopic() {
+  return String(mqtt_topic) + "/cluster/heard";
+}
+
+unsigned long clusterHoldMs() {
+  int ms = atoi(cluster_hold);
+  return ms > 0 ? ms : 0;
+}
+
 // ==========================================
 //         DEVICE MANAGEMENT WEB PAGE
 // ==========================================
@@ -240,13 +607,20 @@ void handleDevicesPage() {
 
   // --- Pending (unapproved) nodes ---
   html += "<h2>Pending Devices</h2>";
-  if (pending_nodes.empty()) {
+  bool anyPending = false;
+  unsigned long now = millis();
+  for (const UnknownNode& n : unknown_nodes) {
+    if (n.id[0] == '\0') continue;
+    anyPending = true;
+    String id = n.id;
+    html += "<div class='dev'><span><span class='name'>" + id + "</span><br>";
+    html += "<small>" + String(n.count) + " frames, " + String(n.last_rssi) + " dBm, ";
+    html += "last " + String((now - n.last_seen) / 1000) + "s ago, ";
+    html += "first " + String((now - n.first_seen) / 1000) + "s ago</small></span>";
+    html += "<a class='btn approve' href='/approve?id=" + id + "'>Approve</a></div>";
+  }
+  if (!anyPending) {
     html += "<div class='none'>No new devices detected yet.</div>";
-  } else {
-    for (const String& id : pending_nodes) {
-      html += "<div class='dev'><span class='name'>" + id + "</span>";
-      html += "<a class='btn approve' href='/approve?id=" + id + "'>Approve</a></div>";
-    }
   }
 
   // --- Approved nodes ---
@@ -350,7 +724,11 @@ void reconnect() {
     if (client.connect(clientId.c_str(), mqtt_user, mqtt_pass,
                        lwt_topic.c_str(), 1, true, "offline")) {
       Serial.println("connected");
+      mqttSessions++;
       client.publish(lwt_topic.c_str(), "online", true);
+      if (clusterHoldMs() > 0) {
+        client.subscribe(clusterTopic().c_str());
+      }
       display.clear();
       display.drawString(0, 0, "MQTT Connected!");
       display.display();
@@ -362,24 +740,397 @@ void reconnect() {
   }
 }
 
+// ==========================================
+//        RECEIVE TIMESTAMPS / CLOCK
+// ==========================================
+void IRAM_ATTR onRxDone() {
+  portENTER_CRITICAL_ISR(&clockMux);
+  rxDoneUs = esp_timer_get_time();
+  portEXIT_CRITICAL_ISR(&clockMux);
+}
+
+// Returns the RxDone stamp of the packet just read, falling back to "now"
+// if the interrupt did not fire.
+int64_t takeRxTimestamp() {
+  portENTER_CRITICAL(&clockMux);
+  int64_t stamp = rxDoneUs;
+  rxDoneUs = 0;
+  portEXIT_CRITICAL(&clockMux);
+  return stamp != 0 ? stamp : esp_timer_get_time();
+}
+
+// Runs in the SNTP task. The first sync (and any large error) steps the
+// offset; later syncs slew it by a quarter of the error so timestamps of
+// consecutive packets never jump.
+void onTimeSync(struct timeval* tv) {
+  int64_t measured = (int64_t)tv->tv_sec * 1000000LL + tv->tv_usec - esp_timer_get_time();
+  portENTER_CRITICAL(&clockMux);
+  int64_t error = measured - utcOffsetUs;
+  if (!clockSynced || llabs(error) > CLOCK_STEP_US) {
+    utcOffsetUs = measured;
+  } else {
+    utcOffsetUs += error / 4;
+  }
+  clockSynced = true;
+  portEXIT_CRITICAL(&clockMux);
+}
+
+void startClockSync() {
+  sntp_set_time_sync_notification_cb(onTimeSync);
+  configTime(0, 0, NTP_SERVER);
+  sntpStarted = true;
+}
+
+// Converts a monotonic esp_timer stamp to an ISO 8601 UTC string.
+// Returns false until SNTP has synced.
+bool formatUtc(int64_t mono_us, char* out, size_t outSize) {
+  portENTER_CRITICAL(&clockMux);
+  bool synced = clockSynced;
+  int64_t utc_us = mono_us + utcOffsetUs;
+  portEXIT_CRITICAL(&clockMux);
+  if (!synced) return false;
+
+  time_t secs = utc_us / 1000000LL;
+  struct tm tm_utc;
+  gmtime_r(&secs, &tm_utc);
+  size_t n = strftime(out, outSize, "%Y-%m-%dT%H:%M:%S", &tm_utc);
+  snprintf(out + n, outSize - n, ".%03dZ", (int)((utc_us / 1000) % 1000));
+  return true;
+}
+
+unsigned long msSince(int64_t mono_us) {
+  return (unsigned long)((esp_timer_get_time() - mono_us) / 1000);
+}
+
+void recordPublishLatency(int64_t rx_us) {
+  unsigned long ms = msSince(rx_us);
+  latencyCount++;
+  latencySumMs += ms;
+  if (ms > latencyMaxMs) latencyMaxMs = ms;
+}
+
+// ==========================================
+//           PUBLISH PIPELINE
+// ==========================================
+uint8_t mqttQos() {
+  return atoi(mqtt_qos) >= 1 ? 1 : 0;
+}
+
+void onPuback(uint16_t packetId) {
+  for (InFlight& f : in_flight) {
+    if (f.used && f.packet_id == packetId) {
+      f.used = false;
+      f.topic = "";
+      f.payload = "";
+      pubAcked++;
+      return;
+    }
+  }
+}
+
+// Next non-zero packet id not held by an in-flight message, so a PUBACK
+// can never match the wrong slot after the 16-bit counter wraps.
+uint16_t allocatePacketId() {
+  for (;;) {
+    uint16_t id = nextPacketId++;
+    if (nextPacketId == 0) nextPacketId = 1;
+    bool inUse = false;
+    for (const InFlight& f : in_flight) {
+      if (f.used && f.packet_id == id) { inUse = true; break; }
+    }
+    if (!inUse) return id;
+  }
+}
+
+int inFlightCount() {
+  int count = 0;
+  for (const InFlight& f : in_flight) {
+    if (f.used) count++;
+  }
+  return count;
+}
+
+// PubSubClient only publishes at QoS 0, so QoS 1 PUBLISH packets are
+// written directly to the (corked) socket.
+void writeQos1Publish(const InFlight& f, bool dup) {
+  size_t topicLen = f.topic.length();
+  size_t payloadLen = f.payload.length();
+  size_t remaining = 2 + topicLen + 2 + payloadLen;
+
+  uint8_t header[8];
+  size_t h = 0;
+  header[h++] = 0x32 | (dup ? 0x08 : 0) | (f.retain ? 0x01 : 0);
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    if (remaining > 0) digit |= 0x80;
+    header[h++] = digit;
+  } while (remaining > 0);
+  header[h++] = topicLen >> 8;
+  header[h++] = topicLen & 0xFF;
+
+  uint8_t pid[2] = { (uint8_t)(f.packet_id >> 8), (uint8_t)(f.packet_id & 0xFF) };
+
+  espClient.write(header, h);
+  espClient.write((const uint8_t*)f.topic.c_str(), topicLen);
+  espClient.write(pid, 2);
+  espClient.write((const uint8_t*)f.payload.c_str(), payloadLen);
+}
+
+// Sends queued messages in one corked burst. While the in-flight window is
+// full, QoS 1 messages stay queued in order but QoS 0 messages behind them
+// (cluster digests, heartbeats) still go out. If the connection drops
+// mid-burst the rest of the queue is kept for the next session. After a
+// reconnect the window is re-sent with DUP set before anything new goes out.
+void pumpPublishQueue() {
+  if (!client.connected()) return;
+
+  espClient.cork();
+
+  if (pipelineSession != mqttSessions) {
+    pipelineSession = mqttSessions;
+    for (const InFlight& f : in_flight) {
+      if (!f.used) continue;
+      writeQos1Publish(f, true);
+      pubRetransmits++;
+    }
+  }
+
+  size_t kept = 0;
+  bool windowFull = false;
+
+  // Leaves a message queued, compacted towards the head in original order
+  auto keep = [&](OutMsg& m, size_t i) {
+    if (kept != i) {
+      publish_queue[(queueHead + kept) % PUBLISH_QUEUE_LEN] = m;
+      m.topic = "";
+      m.payload = "";
+    }
+    kept++;
+  };
+
+  for (size_t i = 0; i < queueCount; i++) {
+    OutMsg& m = publish_queue[(queueHead + i) % PUBLISH_QUEUE_LEN];
+    if (!client.connected()) {
+      keep(m, i);
+      continue;
+    }
+
+    if (m.qos == 0) {
+      if (MQTT_MAX_HEADER_SIZE + 2 + m.topic.length() + m.payload.length() >
+          client.getBufferSize()) {
+        pubDropped++;  // Can never fit PubSubClient's buffer
+        m.topic = "";
+        m.payload = "";
+        continue;
+      }
+      if (!client.publish(m.topic.c_str(), m.payload.c_str(), m.retain)) {
+        keep(m, i);  // Connection lost during the write
+        continue;
+      }
+    } else {
+      InFlight* slot = nullptr;
+      if (!windowFull) {
+        for (InFlight& f : in_flight) {
+          if (!f.used) { slot = &f; break; }
+        }
+      }
+      if (!slot) {
+        windowFull = true;
+        keep(m, i);
+        continue;
+      }
+
+      slot->packet_id = allocatePacketId();
+      slot->used = true;
+      slot->retain = m.retain;
+      slot->topic = m.topic;
+      slot->payload = m.payload;
+      writeQos1Publish(*slot, false);
+    }
+
+    pubSent++;
+    if (m.rx_us != 0) recordPublishLatency(m.rx_us);
+    m.topic = "";
+    m.payload = "";
+  }
+  queueCount = kept;
+
+  espClient.uncork();
+}
+
+// Queues a message for the next pumpPublishQueue(). qos < 0 uses the
+// configured QoS. When the queue is full it is flushed early, and if that
+// cannot make room (offline, window full) the oldest message is dropped.
+void enqueuePublish(const String& topic, const String& payload,
+                    bool retain = false, int64_t rx_us = 0, int qos = -1) {
+  if (queueCount == PUBLISH_QUEUE_LEN) {
+    pumpPublishQueue();
+  }
+  if (queueCount == PUBLISH_QUEUE_LEN) {
+    OutMsg& oldest = publish_queue[queueHead];
+    oldest.topic = "";
+    oldest.payload = "";
+    queueHead = (queueHead + 1) % PUBLISH_QUEUE_LEN;
+    queueCount--;
+    pubDropped++;
+  }
+
+  OutMsg& m = publish_queue[(queueHead + queueCount) % PUBLISH_QUEUE_LEN];
+  m.topic = topic;
+  m.payload = payload;
+  m.retain = retain;
+  m.qos = qos < 0 ? mqttQos() : qos;
+  m.rx_us = rx_us;
+  queueCount++;
+}
+
+#if PUBLISH_BENCHMARK
+// Publishes BENCHMARK_MSGS messages through the direct PubSubClient path and
+// through the pipeline at QoS 0 and 1, and prints delivered publishes/s,
+// drops and bytes per socket write for each. Rates count only messages that
+// were written (QoS 0) or acknowledged (QoS 1). Run against a local broker.
+void runPublishBenchmark() {
+  String topic = String(mqtt_topic) + "/bench";
+  String payload = "{\"id\":\"bench\",\"t\":21.5,\"h\":48,\"v\":3.71,\"rssi\":-87}";
+
+  auto report = [](const char* name, unsigned long startMs, unsigned long done,
+                   unsigned long dropped, unsigned long writes0,
+                   unsigned long bytes0) {
+    unsigned long ms = max(millis() - startMs, 1UL);
+    unsigned long writes = espClient.socketWrites - writes0;
+    unsigned long bytes = espClient.socketBytes - bytes0;
+    Serial.printf("BENCH %-14s %4lu msgs/s (%lu/%d done, %lu dropped), %5lu bytes/write (%lu writes)\n",
+                  name, done * 1000UL / ms, done, BENCHMARK_MSGS, dropped,
+                  writes ? bytes / writes : 0, writes);
+  };
+
+  // Services the connection until the pipeline can take another message
+  // (or has fully drained), so nothing is dropped for lack of room.
+  auto drainUntil = [](size_t maxQueued, bool waitForAcks, unsigned long t0) {
+    while ((queueCount > maxQueued || (waitForAcks && inFlightCount() > 0)) &&
+           client.connected() && millis() - t0 < 10000) {
+      esp_task_wdt_reset();
+      pumpPublishQueue();
+      client.loop();
+    }
+  };
+
+  unsigned long w0 = espClient.socketWrites, b0 = espClient.socketBytes;
+  unsigned long t0 = millis();
+  unsigned long ok = 0;
+  for (int i = 0; i < BENCHMARK_MSGS; i++) {
+    if (client.publish(topic.c_str(), payload.c_str())) ok++;
+  }
+  report("direct qos0", t0, ok, BENCHMARK_MSGS - ok, w0, b0);
+
+  for (int qos = 0; qos <= 1; qos++) {
+    w0 = espClient.socketWrites;
+    b0 = espClient.socketBytes;
+    unsigned long sent0 = pubSent, acked0 = pubAcked, dropped0 = pubDropped;
+    t0 = millis();
+    for (int i = 0; i < BENCHMARK_MSGS; i++) {
+      drainUntil(PUBLISH_QUEUE_LEN - 1, false, t0);
+      enqueuePublish(topic, payload, false, 0, qos);
+    }
+    drainUntil(0, qos == 1, t0);
+    unsigned long done = qos ? pubAcked - acked0 : pubSent - sent0;
+    report(qos ? "pipeline qos1" : "pipeline qos0", t0, done,
+           pubDropped - dropped0, w0, b0);
+  }
+}
+#endif
+
+// ==========================================
+//        CLUSTER PEERS / ELECTION
+// ==========================================
+
+// Election rules and the digest format live in cluster_election.h; these
+// wrappers bind them to this gateway's tables, clock and id.
+
+int livePeerCount() {
+  return countLivePeers(cluster_peers, CLUSTER_MAX_PEERS, millis(),
+                        CLUSTER_PEER_TIMEOUT_MS);
+}
+
+bool peerHeardBetter(const HeldFrame& f) {
+  unsigned long lifetime = 2 * clusterHoldMs() + CLUSTER_DIGEST_SLACK_MS;
+  return anyPeerHeardBetter(peer_digests, CLUSTER_DIGEST_SLOTS, f.hash, f.rssi,
+                            f.snr_q, gw_uid, millis(), lifetime);
+}
+
+void handleClusterMessage(char* msg) {
+  PeerDigest d;
+  ClusterMsgType type = parseClusterMessage(msg, &d);
+  if (type == CLUSTER_MSG_INVALID || strcmp(d.gw, gw_uid) == 0) return;  // Our own echo
+  touchClusterPeer(cluster_peers, CLUSTER_MAX_PEERS, d.gw, millis());
+  if (type != CLUSTER_MSG_DIGEST) return;
+
+  d.seen_at = millis();
+  peer_digests[nextPeerDigest] = d;
+  nextPeerDigest = (nextPeerDigest + 1) % CLUSTER_DIGEST_SLOTS;
+}
+
+void onMqttMessage(char* topic, byte* payload, unsigned int length) {
+  if (clusterHoldMs() == 0 || clusterTopic() != topic) return;
+  char msg[CLUSTER_MSG_LEN];
+  if (length >= sizeof(msg)) return;
+  memcpy(msg, payload, length);
+  msg[length] = '\0';
+  handleClusterMessage(msg);
+}
+
+void announceFrame(const String& id, uint32_t hash, int rssi, int snr_q) {
+  char msg[CLUSTER_MSG_LEN];
+  formatClusterDigest(msg, sizeof(msg), gw_uid, id.c_str(), hash, rssi, snr_q);
+  enqueuePublish(clusterTopic(), msg, false, 0, 0);
+}
+
+void publishClusterHeartbeat() {
+  enqueuePublish(clusterTopic(), gw_uid, false, 0, 0);
+}
+
 // ==========================================
 //         GATEWAY STATUS PUBLISHING
 // ==========================================
 void publishGatewayStatus() {
   if (!client.connected()) return;
 
-  StaticJsonDocument<256> doc;
+  StaticJsonDocument<768> doc;
   doc["uptime_s"] = millis() / 1000;
   doc["free_heap"] = ESP.getFreeHeap();
   doc["wifi_rssi"] = WiFi.RSSI();
   doc["packets_rx"] = packetCount;
+  doc["unknown_rx"] = unknownFrames;
+  doc["unknown_dropped"] = unknownDropped;
+  doc["unknown_evicted"] = unknownEvicted;
+  doc["clock_synced"] = clockSynced;
+  if (clusterHoldMs() > 0) {
+    doc["cluster_peers"] = livePeerCount();
+    doc["cluster_fwd"] = clusterForwarded;
+    doc["cluster_suppressed"] = clusterSuppressed;
+  }
+  if (latencyCount > 0) {
+    doc["rx_pub_lat_avg_ms"] = latencySumMs / latencyCount;
+    doc["rx_pub_lat_max_ms"] = latencyMaxMs;
+  }
+  latencyCount = 0;
+  latencySumMs = 0;
+  latencyMaxMs = 0;
+  doc["pub_sent"] = pubSent;
+  doc["pub_acked"] = pubAcked;
+  doc["pub_dropped"] = pubDropped;
+  doc["pub_retransmits"] = pubRetransmits;
+  doc["pub_inflight"] = inFlightCount();
+  doc["sock_writes"] = espClient.socketWrites;
+  doc["sock_bytes"] = espClient.socketBytes;
   doc["ip"] = WiFi.localIP().toString();
 
   String payload;
   serializeJson(doc, payload);
 
   String topic = String(mqtt_topic) + "/gateway/state";
-  client.publish(topic.c_str(), payload.c_str(), true);
+  enqueuePublish(topic, payload, true);
 }
 
 // ==========================================
@@ -406,14 +1157,25 @@ void sendAutoDiscovery(const String& node_id) {
   String dev_buf;
   serializeJson(dev, dev_buf);
 
+  bool split = splitTopics();
+
   auto publishEntity = [&](const char* component, const char* suffix,
-                           const char* name_suffix, const char* val_tpl,
-                           const char* unit, const char* dev_class,
-                           const char* ent_cat = "", int precision = -1) {
+                           const char* name_suffix, const char* field,
+                           const char* val_tpl, const char* unit,
+                           const char* dev_class, const char* ent_cat = "",
+                           int precision = -1) {
     doc.clear();
     doc["name"] = node_id + " " + name_suffix;
-    doc["stat_t"] = state_topic;
-    doc["val_tpl"] = val_tpl;
+    if (split) {
+      doc["stat_t"] = state_topic + "/" + field;
+      if (strcmp(component, "binary_sensor") == 0) {
+        doc["pl_on"] = "1";
+        doc["pl_off"] = "0";
+      }
+    } else {
+      doc["stat_t"] = state_topic;
+      doc["val_tpl"] = val_tpl;
+    }
     if (strlen(unit) > 0) doc["unit_of_meas"] = unit;
     if (strlen(dev_class) > 0) doc["dev_cla"] = dev_class;
     doc["uniq_id"] = "lora_" + safe_id + "_" + suffix;
@@ -429,25 +1191,54 @@ void sendAutoDiscovery(const String& node_id) {
     String topic = "homeassistant/" + String(component) + "/lora_" + safe_id + "_" + suffix + "/config";
     String buffer;
     serializeJson(doc, buffer);
-    client.publish(topic.c_str(), buffer.c_str(), true);
+    enqueuePublish(topic, buffer, true);
   };
 
-  publishEntity("sensor", "t", "Temperature", "{{ value_json.t }}", "\u00b0C", "temperature");
-  publishEntity("sensor", "h", "Humidity",    "{{ value_json.h }}", "%",    "humidity");
-  publishEntity("sensor", "v", "Battery",     "{{ value_json.v }}", "V",    "voltage", "", 2);
-  publishEntity("sensor", "r", "Signal",      "{{ value_json.rssi }}", "dBm", "signal_strength");
+  publishEntity("sensor", "t", "Temperature", "t", "{{ value_json.t }}", "\u00b0C", "temperature");
+  publishEntity("sensor", "h", "Humidity",    "h", "{{ value_json.h }}", "%",    "humidity");
+  publishEntity("sensor", "v", "Battery",     "v", "{{ value_json.v }}", "V",    "voltage", "", 2);
+  publishEntity("sensor", "r", "Signal",      "rssi", "{{ value_json.rssi }}", "dBm", "signal_strength");
 
-  publishEntity("sensor", "boot", "Boot Count",
+  publishEntity("sensor", "boot", "Boot Count", "boot",
                 "{{ value_json.boot | default(0) }}", "restarts", "",
                 "diagnostic");
 
-  publishEntity("binary_sensor", "lb", "Low Battery",
+  publishEntity("binary_sensor", "lb", "Low Battery", "lb",
                 "{{ 'ON' if value_json.lb is defined and value_json.lb == 1 else 'OFF' }}",
                 "", "battery");
 
-  publishEntity("sensor", "err", "Error",
+  publishEntity("sensor", "err", "Error", "err",
                 "{{ value_json.err | default('none') }}", "", "",
                 "diagnostic");
+
+  publishEntity("sensor", "ts", "Last Received", "ts",
+                "{{ value_json.ts | default(None) }}", "", "timestamp",
+                "diagnostic");
+}
+
+// Publishes each field of a reading to <base>/<field> as a plain value.
+// Missing boot/lb/err fields get their JSON-mode defaults.
+// The pipeline flushes all fields in one socket write; only the first
+// carries rx_us so each reading counts once in the latency stats.
+void publishReadingFields(const String& base, JsonObject reading, int64_t rx_us) {
+  for (JsonPair kv : reading) {
+    if (strcmp(kv.key().c_str(), "id") == 0) continue;
+    String value;
+    if (kv.value().is<const char*>()) {
+      value = kv.value().as<const char*>();
+    } else {
+      serializeJson(kv.value(), value);
+    }
+    String topic = base + "/" + kv.key().c_str();
+    enqueuePublish(topic, value, false, rx_us);
+    rx_us = 0;
+  }
+
+  // Same fallbacks as the JSON-mode templates' default(...), so entities for
+  // fields a node never sends don't stay "unknown"
+  if (!reading.containsKey("boot")) enqueuePublish(base + "/boot", "0");
+  if (!reading.containsKey("lb"))   enqueuePublish(base + "/lb", "0");
+  if (!reading.containsKey("err"))  enqueuePublish(base + "/err", "none");
 }
 
 void sendGatewayDiscovery() {
@@ -487,12 +1278,116 @@ void sendGatewayDiscovery() {
     String topic = "homeassistant/sensor/" + gw_id + "_" + suffix + "/config";
     String buffer;
     serializeJson(doc, buffer);
-    client.publish(topic.c_str(), buffer.c_str(), true);
+    enqueuePublish(topic, buffer, true);
   };
 
   publishGwSensor("wifi", "WiFi Signal", "{{ value_json.wifi_rssi }}", "dBm", "signal_strength");
   publishGwSensor("heap", "Free Memory", "{{ value_json.free_heap }}", "B", "");
   publishGwSensor("pkts", "Packets Received", "{{ value_json.packets_rx }}", "pkts", "");
+  publishGwSensor("lat", "Receive Latency", "{{ value_json.rx_pub_lat_avg_ms | default(0) }}", "ms", "duration");
+}
+
+// ==========================================
+//           READING FORWARDING
+// ==========================================
+// In split mode the already-parsed reading is used when the caller has it;
+// held frames only keep the serialized payload and are parsed again. If that
+// parse fails the reading is published as JSON rather than truncated.
+void forwardReading(const String& id, const String& topic,
+                    const String& payload, int64_t rx_us,
+                    JsonObject reading = JsonObject()) {
+  if (discovered_nodes.find(id) == discovered_nodes.end()) {
+    sendAutoDiscovery(id);
+    discovered_nodes.insert(id);
+  }
+
+  if (splitTopics()) {
+    if (!reading.isNull()) {
+      publishReadingFields(topic, reading, rx_us);
+      return;
+    }
+    StaticJsonDocument<512> doc;
+    DeserializationError error = deserializeJson(doc, payload);
+    if (!error) {
+      publishReadingFields(topic, doc.as<JsonObject>(), rx_us);
+      return;
+    }
+    Serial.print("Split publish failed (");
+    Serial.print(error.c_str());
+    Serial.println("), sending JSON");
+  }
+  enqueuePublish(topic, payload, false, rx_us);
+}
+
+// Decides a held frame's election. The winner of a node's first election
+// also owns its discovery: losers mark the node discovered without sending.
+void releaseHeldFrame(HeldFrame& f) {
+  if (peerHeardBetter(f)) {
+    clusterSuppressed++;
+    discovered_nodes.insert(f.id);
+  } else {
+    clusterForwarded++;
+    forwardReading(f.id, f.topic, f.payload, f.rx_us);
+  }
+  f.used = false;
+  f.id = "";
+  f.topic = "";
+  f.payload = "";
+}
+
+void holdFrame(const String& id, uint32_t hash, int rssi, int snr_q,
+               const String& topic, const String& payload, int64_t rx_us) {
+  unsigned long now = millis();
+  HeldFrame* slot = nullptr;
+  for (HeldFrame& f : held_frames) {
+    if (!f.used) { slot = &f; break; }
+    if (!slot || now - f.heard_at > now - slot->heard_at) slot = &f;
+  }
+  if (slot->used) releaseHeldFrame(*slot);  // Table full: decide the oldest early
+
+  slot->used = true;
+  slot->hash = hash;
+  slot->rssi = rssi;
+  slot->snr_q = snr_q;
+  slot->heard_at = now;
+  slot->rx_us = rx_us;
+  slot->id = id;
+  slot->topic = topic;
+  slot->payload = payload;
+}
+
+void processHeldFrames() {
+  unsigned long now = millis();
+  unsigned long hold = clusterHoldMs();
+  for (HeldFrame& f : held_frames) {
+    if (f.used && now - f.heard_at >= hold) releaseHeldFrame(f);
+  }
+}
+
+// ==========================================
+//        UNKNOWN NODE HANDLING
+// ==========================================
+// Frames from unapproved IDs are always counted and, if the id fits, tracked
+// (bounded work), but logging and the OLED redraw are rate limited so an
+// on-air flood cannot keep the gateway busy.
+void handleUnknownNode(const char* id, int rssi) {
+  unknownFrames++;
+
+  if (!trackUnknownNode(id, rssi) || !takeUnknownToken()) {
+    unknownDropped++;
+    return;
+  }
+
+  String ip = WiFi.localIP().toString();
+  Serial.println("RX PENDING: " + String(id) + " — approve via http://" + ip + "/devices");
+  wakeDisplay(WAKE_ON_PACKET_MS);
+  display.clear();
+  display.setFont(ArialMT_Plain_10);
+  display.drawString(0, 0, "New device: " + String(id));
+  display.drawString(0, 15, "Approve at:");
+  display.drawString(0, 30, "http://" + ip + "/devices");
+  drawFooter();
+  display.display();
 }
 
 // ==========================================
@@ -523,6 +1418,16 @@ void setup() {
   if(preferences.getString("devname", "").length() > 0){
      preferences.getString("devname").toCharArray(device_name, FIELD_LEN);
   }
+  if(preferences.getString("pubmode", "").length() > 0){
+     preferences.getString("pubmode").toCharArray(publish_mode, MODE_LEN);
+  }
+  if(preferences.getString("cluster", "").length() > 0){
+     preferences.getString("cluster").toCharArray(cluster_hold, PORT_LEN);
+  }
+  if(preferences.getString("qos", "").length() > 0){
+     preferences.getString("qos").toCharArray(mqtt_qos, QOS_LEN);
+  }
+  snprintf(gw_uid, sizeof(gw_uid), "%012llx", (unsigned long long)ESP.getEfuseMac());
   preferences.getString("allow", "").toCharArray(allowed_nodes, ALLOWLIST_LEN);
 
   WiFi.setHostname(device_name);
@@ -533,6 +1438,9 @@ void setup() {
   custom_mqtt_pass.setValue(mqtt_pass, FIELD_LEN);
   custom_mqtt_topic.setValue(mqtt_topic, FIELD_LEN);
   custom_device_name.setValue(device_name, FIELD_LEN);
+  custom_pub_mode.setValue(publish_mode, MODE_LEN);
+  custom_cluster.setValue(cluster_hold, PORT_LEN);
+  custom_mqtt_qos.setValue(mqtt_qos, QOS_LEN);
 
   SPI.begin(SCK_PIN, MISO_PIN, MOSI_PIN, SS_PIN);
   LoRa.setPins(SS_PIN, RST_PIN, DI0_PIN);
@@ -545,6 +1453,10 @@ void setup() {
   LoRa.setSpreadingFactor(LORA_SF);
   LoRa.enableCrc();
 
+  // DIO0 is mapped to RxDone by default; stamp it for receive timestamps
+  pinMode(DI0_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(DI0_PIN), onRxDone, RISING);
+
   wm.setConfigPortalBlocking(false);
   wm.setSaveConfigCallback(saveConfigCallback);
 
@@ -559,6 +1471,9 @@ void setup() {
   wm.addParameter(&custom_mqtt_user);
   wm.addParameter(&custom_mqtt_pass);
   wm.addParameter(&custom_mqtt_topic);
+  wm.addParameter(&custom_pub_mode);
+  wm.addParameter(&custom_cluster);
+  wm.addParameter(&custom_mqtt_qos);
 
   display.clear();
   display.drawString(0, 0, "Connecting WiFi...");
@@ -580,6 +1495,8 @@ void setup() {
 
   client.setServer(mqtt_server, atoi(mqtt_port));
   client.setBufferSize(MQTT_BUFFER_SIZE);
+  client.setCallback(onMqttMessage);
+  espClient.onPuback(onPuback);
 
   // Setup OTA updates
   ArduinoOTA.setHostname(device_name);
@@ -650,6 +1567,9 @@ void loop() {
     safeCopy(mqtt_pass,   custom_mqtt_pass.getValue(),   sizeof(mqtt_pass));
     safeCopy(mqtt_topic,  custom_mqtt_topic.getValue(),  sizeof(mqtt_topic));
     safeCopy(device_name, custom_device_name.getValue(), sizeof(device_name));
+    safeCopy(publish_mode, custom_pub_mode.getValue(),   sizeof(publish_mode));
+    safeCopy(cluster_hold, custom_cluster.getValue(),    sizeof(cluster_hold));
+    safeCopy(mqtt_qos,    custom_mqtt_qos.getValue(),    sizeof(mqtt_qos));
 
     preferences.putString("server", mqtt_server);
     preferences.putString("port", mqtt_port);
@@ -657,6 +1577,9 @@ void loop() {
     preferences.putString("pass", mqtt_pass);
     preferences.putString("topic", mqtt_topic);
     preferences.putString("devname", device_name);
+    preferences.putString("pubmode", publish_mode);
+    preferences.putString("cluster", cluster_hold);
+    preferences.putString("qos", mqtt_qos);
 
     discovered_nodes.clear();
     client.disconnect();
@@ -670,6 +1593,9 @@ void loop() {
   }
 
   if (WiFi.status() == WL_CONNECTED) {
+      if (!sntpStarted) {
+        startClockSync();
+      }
       if (!client.connected()) {
         reconnect();
       }
@@ -684,10 +1610,28 @@ void loop() {
         }
         publishGatewayStatus();
       }
+
+      if (client.connected() && clusterHoldMs() > 0 &&
+          millis() - lastClusterHeartbeat > CLUSTER_HEARTBEAT_MS) {
+        lastClusterHeartbeat = millis();
+        publishClusterHeartbeat();
+      }
+
+#if PUBLISH_BENCHMARK
+      static bool benchmarkDone = false;
+      if (client.connected() && !benchmarkDone) {
+        benchmarkDone = true;
+        runPublishBenchmark();
+      }
+#endif
   }
 
+  processHeldFrames();
+  pumpPublishQueue();
+
   int packetSize = LoRa.parsePacket();
   if (packetSize) {
+    int64_t rx_us = takeRxTimestamp();
     String raw_data;
     raw_data.reserve(packetSize);
     while (LoRa.available()) {
@@ -697,48 +1641,66 @@ void loop() {
     int rssi = LoRa.packetRssi();
     packetCount++;
 
-    StaticJsonDocument<300> doc;
+    // Cheap early rejection of unapproved nodes before the full JSON parse
+    char early_id[FIELD_LEN];
+    if (peekNodeId(raw_data.c_str(), early_id, sizeof(early_id)) &&
+        !isNodeAllowed(early_id)) {
+      handleUnknownNode(early_id, rssi);
+      return;
+    }
+
+    StaticJsonDocument<384> doc;
     DeserializationError error = deserializeJson(doc, raw_data);
 
     String finalTopic = mqtt_topic;
     String incoming;
+    String id;
 
     if (!error) {
         if (doc.containsKey("id")) {
-            String id = doc["id"].as<String>();
+            id = doc["id"].as<String>();
 
-            if (!isNodeAllowed(id)) {
+            if (!isNodeAllowed(id.c_str())) {
               // Track as pending — will appear on the /devices web page
-              pending_nodes.insert(id);
-              Serial.println("RX PENDING: " + id + " — approve via http://" + WiFi.localIP().toString() + "/devices");
-              wakeDisplay(WAKE_ON_PACKET_MS);
-              display.clear();
-              display.setFont(ArialMT_Plain_10);
-              display.drawString(0, 0, "New device: " + id);
-              display.drawString(0, 15, "Approve at:");
-              display.drawString(0, 30, "http://" + WiFi.localIP().toString() + "/devices");
-              drawFooter();
-              display.display();
+              handleUnknownNode(id.c_str(), rssi);
               return;
             }
 
-            if (discovered_nodes.find(id) == discovered_nodes.end()) {
-              sendAutoDiscovery(id);
-              discovered_nodes.insert(id);
-            }
-
             String safe_id = id;
             safe_id.toLowerCase();
             finalTopic = String(mqtt_topic) + "/" + safe_id;
         }
 
         doc["rssi"] = rssi;
+        char ts[32];
+        if (formatUtc(rx_us, ts, sizeof(ts))) {
+          doc["ts"] = ts;
+        }
+#if PAYLOAD_LATENCY
+        doc["lat_ms"] = msSince(rx_us);
+#endif
         serializeJson(doc, incoming);
 
         Serial.print("RX: ");
         Serial.println(incoming);
 
-        client.publish(finalTopic.c_str(), incoming.c_str());
+        if (id.length() == 0) {
+          enqueuePublish(finalTopic, incoming, false, rx_us);
+        } else if (clusterHoldMs() > 0 && client.connected()) {
+          // Always announce; only hold for an election while peers are alive,
+          // otherwise fall back to forwarding straight away
+          int snr_q = (int)lroundf(LoRa.packetSnr() * 4);
+          uint32_t hash = frameHash(raw_data.c_str(), raw_data.length());
+          announceFrame(id, hash, rssi, snr_q);
+          if (livePeerCount() > 0) {
+            holdFrame(id, hash, rssi, snr_q, finalTopic, incoming, rx_us);
+          } else {
+            forwardReading(id, finalTopic, incoming, rx_us, doc.as<JsonObject>());
+          }
+        } else {
+          forwardReading(id, finalTopic, incoming, rx_us, doc.as<JsonObject>());
+        }
+        pumpPublishQueue();
 
         wakeDisplay(WAKE_ON_PACKET_MS);
         display.clear();
@@ -751,7 +1713,8 @@ void loop() {
     } else {
         Serial.print("RX (Raw): ");
         Serial.println(raw_data);
-        client.publish(finalTopic.c_str(), raw_data.c_str());
+        enqueuePublish(finalTopic, raw_data, false, rx_us);
+        pumpPublishQueue();
     }
   }
 }
@@ -0,0 +1,126 @@
+#include <unity.h>
+#include "cluster_election.h"
+
+#define GW_A "24a160aaaaaa"
+#define GW_B "24a160bbbbbb"
+#define HOLD_LIFETIME 1600  // 2 * 300 ms hold + slack
+
+void setUp() {}
+void tearDown() {}
+
+// Runs one side of an election the way the gateway does: the peer's digest
+// goes through the wire format, then our held frame is compared against it.
+static bool forwards(const char* self, int rssi, int snr_q,
+                     const char* peer, int peerRssi, int peerSnrQ) {
+  char msg[CLUSTER_MSG_LEN];
+  formatClusterDigest(msg, sizeof(msg), peer, "node1", 0xdeadbeef, peerRssi, peerSnrQ);
+
+  PeerDigest digests[4] = {};
+  TEST_ASSERT_EQUAL(CLUSTER_MSG_DIGEST, parseClusterMessage(msg, &digests[0]));
+  digests[0].seen_at = 1000;
+  return !anyPeerHeardBetter(digests, 4, 0xdeadbeef, rssi, snr_q, self, 1100, HOLD_LIFETIME);
+}
+
+void test_frame_hash_is_fnv1a() {
+  TEST_ASSERT_EQUAL_HEX32(0x811c9dc5, frameHash("", 0));
+  TEST_ASSERT_EQUAL_HEX32(0xe40c292c, frameHash("a", 1));
+  TEST_ASSERT_NOT_EQUAL(frameHash("{\"id\":\"n1\",\"t\":21}", 19),
+                        frameHash("{\"id\":\"n1\",\"t\":22}", 19));
+}
+
+void test_digest_round_trip_with_commas_in_node_id() {
+  char msg[CLUSTER_MSG_LEN];
+  formatClusterDigest(msg, sizeof(msg), GW_A, "shed,north,2", 0x0badf00d, -87, 31);
+  TEST_ASSERT_EQUAL_STRING(GW_A ",shed,north,2,0badf00d,-87,31", msg);
+
+  PeerDigest d = {};
+  TEST_ASSERT_EQUAL(CLUSTER_MSG_DIGEST, parseClusterMessage(msg, &d));
+  TEST_ASSERT_EQUAL_STRING(GW_A, d.gw);
+  TEST_ASSERT_EQUAL_HEX32(0x0badf00d, d.hash);
+  TEST_ASSERT_EQUAL(-87, d.rssi);
+  TEST_ASSERT_EQUAL(31, d.snr_q);
+}
+
+void test_heartbeat_and_malformed_messages() {
+  PeerDigest d = {};
+  char heartbeat[] = GW_B;
+  TEST_ASSERT_EQUAL(CLUSTER_MSG_HEARTBEAT, parseClusterMessage(heartbeat, &d));
+  TEST_ASSERT_EQUAL_STRING(GW_B, d.gw);
+
+  char tooFewFields[] = GW_B ",node1,-80,12";
+  TEST_ASSERT_EQUAL(CLUSTER_MSG_INVALID, parseClusterMessage(tooFewFields, &d));
+
+  char empty[] = "";
+  TEST_ASSERT_EQUAL(CLUSTER_MSG_INVALID, parseClusterMessage(empty, &d));
+
+  char longGw[] = "0123456789abcdef,node1,00000001,-80,12";
+  TEST_ASSERT_EQUAL(CLUSTER_MSG_INVALID, parseClusterMessage(longGw, &d));
+}
+
+void test_quarter_db_snr_tie_falls_to_gateway_id() {
+  // Both hear -90 dBm at 7.75 dB (31 quarter dB): only the lower id forwards
+  TEST_ASSERT_TRUE(forwards(GW_A, -90, 31, GW_B, -90, 31));
+  TEST_ASSERT_FALSE(forwards(GW_B, -90, 31, GW_A, -90, 31));
+
+  // One quarter dB apart is a real difference, regardless of id
+  TEST_ASSERT_FALSE(forwards(GW_A, -90, 30, GW_B, -90, 31));
+  TEST_ASSERT_TRUE(forwards(GW_B, -90, 31, GW_A, -90, 30));
+}
+
+void test_exactly_one_of_two_gateways_wins() {
+  const int rssis[] = { -120, -95, -90, -60 };
+  const int snrs[] = { -40, -1, 0, 31, 32 };
+  for (int ra : rssis) for (int sa : snrs) {
+    for (int rb : rssis) for (int sb : snrs) {
+      bool a = forwards(GW_A, ra, sa, GW_B, rb, sb);
+      bool b = forwards(GW_B, rb, sb, GW_A, ra, sa);
+      TEST_ASSERT_TRUE_MESSAGE(a != b, "exactly one gateway must forward");
+    }
+  }
+}
+
+void test_forwards_when_no_digest_arrives() {
+  PeerDigest digests[4] = {};
+  TEST_ASSERT_FALSE(anyPeerHeardBetter(digests, 4, 0x1234, -120, -40, GW_B, 5000, HOLD_LIFETIME));
+
+  // A better digest for a different frame does not count
+  char other[CLUSTER_MSG_LEN];
+  formatClusterDigest(other, sizeof(other), GW_A, "node1", 0x9999, -40, 40);
+  parseClusterMessage(other, &digests[0]);
+  digests[0].seen_at = 4900;
+  TEST_ASSERT_FALSE(anyPeerHeardBetter(digests, 4, 0x1234, -120, -40, GW_B, 5000, HOLD_LIFETIME));
+
+  // Neither does a better digest for the same hash that has expired
+  digests[0].hash = 0x1234;
+  digests[0].seen_at = 5000 - HOLD_LIFETIME - 1;
+  TEST_ASSERT_FALSE(anyPeerHeardBetter(digests, 4, 0x1234, -120, -40, GW_B, 5000, HOLD_LIFETIME));
+}
+
+void test_peers_go_silent_after_timeout() {
+  ClusterPeer peers[2] = {};
+  TEST_ASSERT_EQUAL(0, countLivePeers(peers, 2, 0, 30000));
+
+  touchClusterPeer(peers, 2, GW_A, 1000);
+  touchClusterPeer(peers, 2, GW_B, 2000);
+  touchClusterPeer(peers, 2, GW_A, 3000);
+  TEST_ASSERT_EQUAL(2, countLivePeers(peers, 2, 4000, 30000));
+  TEST_ASSERT_EQUAL(1, countLivePeers(peers, 2, 32500, 30000));
+  TEST_ASSERT_EQUAL(0, countLivePeers(peers, 2, 33000, 30000));
+
+  // A third peer replaces the least recently heard one
+  touchClusterPeer(peers, 2, "24a160cccccc", 40000);
+  TEST_ASSERT_EQUAL(1, countLivePeers(peers, 2, 40000, 30000));
+  TEST_ASSERT_EQUAL_STRING(GW_A, peers[0].gw);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_frame_hash_is_fnv1a);
+  RUN_TEST(test_digest_round_trip_with_commas_in_node_id);
+  RUN_TEST(test_heartbeat_and_malformed_messages);
+  RUN_TEST(test_quarter_db_snr_tie_falls_to_gateway_id);
+  RUN_TEST(test_exactly_one_of_two_gateways_wins);
+  RUN_TEST(test_forwards_when_no_digest_arrives);
+  RUN_TEST(test_peers_go_silent_after_timeout);
+  return UNITY_END();
+}